@@ -38,15 +38,55 @@ typedef uint16_t particle_t;
 
 static particle_t particles[CANVAS_HEIGHT][CANVAS_WIDTH]; // y,x
 
+// One bit per framebuffer byte (four cells) that needs rewriting, per row
+static uint64_t dirty_canvas_bytes[CANVAS_HEIGHT];
+
+// Census of the canvas, kept up to date by the particle setters. The grid is
+// zero-initialised, so it starts out as all air. Material changes made while
+// simulating count as reactions; the rest (brush, loading) count as edits.
+static uint16_t material_counts[16] = {[MATERIAL_AIR_ID] = CANVAS_WIDTH * CANVAS_HEIGHT};
+static uint16_t cells_moved = 0;
+static uint16_t reactions_fired = 0;
+static uint16_t cells_edited = 0;
+static bool simulating = false;
+static bool world_at_rest = false;
+
 particle_t* get_particle(uint8_t x, uint8_t y) {
   return &particles[y][x];
 }
 
+bool is_canvas_particle(particle_t *particle) {
+  return particle >= &particles[0][0] && particle < &particles[0][0] + CANVAS_WIDTH * CANVAS_HEIGHT;
+}
+
+void mark_particle_dirty(particle_t *particle) {
+  if (!is_canvas_particle(particle)) {
+    return;
+  }
+  long index = particle - &particles[0][0];
+  dirty_canvas_bytes[index / CANVAS_WIDTH] |= 1ULL << ((index % CANVAS_WIDTH) >> 2);
+}
+
+void mark_canvas_dirty(void) {
+  for (int y = 0; y < CANVAS_HEIGHT; y++) {
+    dirty_canvas_bytes[y] = ~0ULL;
+  }
+}
+
 void move_particle(uint8_t x1, uint8_t y1, uint8_t x2, uint8_t y2) {
   particle_t *particle_one = get_particle(x1, y1);
   particle_t *particle_two = get_particle(x2, y2);
   particle_t particle_buffer = *particle_one;
 
+  if ((*particle_one ^ *particle_two) & PARTICLE_COLOR_BITS) {
+    mark_particle_dirty(particle_one);
+    mark_particle_dirty(particle_two);
+  }
+  if ((*particle_one ^ *particle_two) & PARTICLE_MATERIAL_BITS) {
+    cells_moved++;
+    world_at_rest = false;
+  }
+
   *particle_one = *particle_two;
   *particle_two = particle_buffer;
 }
@@ -57,6 +97,9 @@ void set_particle_state(particle_t *particle, uint8_t value, int bits, int offse
 }
 
 void set_particle_color(particle_t *particle, uint8_t color) {
+  if (((*particle & PARTICLE_COLOR_BITS) >> PARTICLE_COLOR_BIT_OFFSET) != color) {
+    mark_particle_dirty(particle);
+  }
   set_particle_state(particle, color, PARTICLE_COLOR_BITS, PARTICLE_COLOR_BIT_OFFSET);
 }
 
@@ -65,6 +108,17 @@ void set_particle_updated(particle_t *particle, bool value) {
 }
 
 void set_particle_material_id(particle_t *particle, uint8_t material_id) {
+  uint8_t previous_material_id = (*particle & PARTICLE_MATERIAL_BITS) >> PARTICLE_MATERIAL_BIT_OFFSET;
+  if (previous_material_id != material_id && is_canvas_particle(particle)) {
+    material_counts[previous_material_id]--;
+    material_counts[material_id]++;
+    if (simulating) {
+      reactions_fired++;
+    } else {
+      cells_edited++;
+    }
+    world_at_rest = false;
+  }
   set_particle_state(particle, material_id, PARTICLE_MATERIAL_BITS, PARTICLE_MATERIAL_BIT_OFFSET);
 }
 
@@ -92,72 +146,178 @@ uint8_t get_particle_age(particle_t *particle) {
   return get_particle_state(particle, PARTICLE_AGE_BITS, PARTICLE_AGE_BIT_OFFSET);
 }
 
-particle_t* update_spout(uint8_t x, uint8_t y) {
-  particle_t *particle = get_particle(x, y);
-  set_particle_color(particle, 2);
-  if (paused == false) {
-    if (get_particle_material_id(get_particle(x, y + 1)) == MATERIAL_AIR_ID) {
-      if ((rand() % 100) < 20) {
-        particle_t *particle = get_particle(x, y + 1);
-        set_particle_color(particle, 2);
-      }
-    } 
+uint16_t get_material_count(uint8_t material_id) {
+  return material_counts[material_id & 0b1111];
+}
+
+// Cells that changed place during the last tick
+uint16_t get_cells_moved(void) {
+  return cells_moved;
+}
+
+// Cells that changed material through the simulation during the last tick
+uint16_t get_reactions_fired(void) {
+  return reactions_fired;
+}
+
+// Cells painted, erased or loaded since the last tick started
+uint16_t get_cells_edited(void) {
+  return cells_edited;
+}
+
+// True once an unpaused tick has passed with nothing moving or reacting and
+// nothing left that changes by itself (fire, lava, torches, spouts)
+bool is_world_at_rest(void) {
+  return world_at_rest;
+}
+
+#define EMITTER_WORDS_PER_ROW (CANVAS_WIDTH / 32)
+#define EMITTER_WHEEL_SLOTS 16
+#define EMITTER_ROW_BYTES (CANVAS_HEIGHT / 8)
+
+// Delays (in ticks) between emitter events, picked uniformly with one rand().
+// Torches average ~3.3 ticks (the old 30% per-tick roll), spouts ~5 (20%).
+// All delays are shorter than the timing wheel below.
+const uint8_t torch_event_delays[16] = {1,1,1,1,1,2,2,2,3,3,4,4,5,6,8,9};
+const uint8_t spout_event_delays[16] = {1,1,1,2,2,2,3,3,4,5,6,7,8,10,12,13};
+
+// One bit per torch or spout cell, per row
+static uint32_t emitter_cells[CANVAS_HEIGHT][EMITTER_WORDS_PER_ROW];
+
+// Timing wheel: for each slot, one bit per row that has an emitter due when
+// the tick reaches that slot. Emitters never age, so each one keeps the slot
+// of its next event in its age bits.
+static uint8_t emitter_due_rows[EMITTER_WHEEL_SLOTS][EMITTER_ROW_BYTES];
+static uint8_t emitter_tick = 0;
+
+bool is_emitter_material(uint8_t material_id) {
+  return material_id == MATERIAL_TORCH_ID || material_id == MATERIAL_SPOUT_ID;
+}
+
+void mark_emitter_row_due(uint8_t slot, uint8_t y) {
+  emitter_due_rows[slot][y >> 3] |= 1 << (y & 7);
+}
+
+void schedule_emitter(particle_t *particle, uint8_t y) {
+  const uint8_t *delays = get_particle_material_id(particle) == MATERIAL_TORCH_ID
+    ? torch_event_delays
+    : spout_event_delays;
+  uint8_t slot = (emitter_tick + delays[rand() & 15]) & (EMITTER_WHEEL_SLOTS - 1);
+  set_particle_age(particle, slot);
+  mark_emitter_row_due(slot, y);
+}
+
+void register_emitter(uint8_t x, uint8_t y, uint8_t material_id) {
+  if (x >= CANVAS_WIDTH || y >= CANVAS_HEIGHT) {
+    return;
   }
 
+  particle_t *particle = get_particle(x, y);
+  set_particle_material_id(particle, material_id);
+  set_particle_color(particle, material_id == MATERIAL_TORCH_ID ? 3 : 2);
+  schedule_emitter(particle, y);
+
+  emitter_cells[y][x >> 5] |= 1u << (x & 31);
+}
+
+void unregister_emitter(uint8_t x, uint8_t y) {
+  if (x >= CANVAS_WIDTH || y >= CANVAS_HEIGHT) {
+    return;
+  }
+  // A leftover due bit for this row is harmless; the row scan finds no cell
+  emitter_cells[y][x >> 5] &= ~(1u << (x & 31));
+}
 
-  return particle;
+// Brush placement; torches and spouts are also added to the registry
+void place_material(uint8_t x, uint8_t y, uint8_t material_id) {
+  if (is_emitter_material(material_id)) {
+    register_emitter(x, y, material_id);
+  } else {
+    set_particle_material_id(get_particle(x, y), material_id);
+  }
 }
 
-particle_t* update_torch(uint8_t x, uint8_t y) {
+void spawn_fire(uint8_t x, uint8_t y) {
   particle_t *particle = get_particle(x, y);
+  if (get_particle_material_id(particle) == MATERIAL_AIR_ID) {
+    set_particle_material_id(particle, MATERIAL_FIRE_ID);
+    set_particle_color(particle, 3);
+    set_particle_age(particle, 0);
+  }
+}
 
-  if (get_particle_color(particle) == 0 || paused == false){
-    if ((rand() % 100) < 30) {
-      set_particle_color(particle, 1);
-    } else {
-      set_particle_color(particle, 3);
-    }
+void update_spout(uint8_t x, uint8_t y) {
+  if (y < CANVAS_HEIGHT - 1 && get_particle_material_id(get_particle(x, y + 1)) == MATERIAL_AIR_ID) {
+    set_particle_color(get_particle(x, y + 1), 2);
+  }
+}
 
-    if (get_particle_material_id(get_particle(x, y - 1)) == MATERIAL_AIR_ID) {
-      if ((rand() % 100) < 30) {
-        particle_t *particle = get_particle(x, y - 1);
-        set_particle_material_id(particle, MATERIAL_FIRE_ID);
-        set_particle_color(particle, 3);
-        set_particle_age(particle, 0);
-      }
-    } 
+void update_torch(uint8_t x, uint8_t y) {
+  // Flare on the event tick, then settle back to the dim colour
+  set_particle_color(get_particle(x, y), 1);
 
-    if (get_particle_material_id(get_particle(x, y + 1)) == MATERIAL_AIR_ID) {
-      if ((rand() % 100) < 30) {
-        particle_t *particle = get_particle(x, y + 1);
-        set_particle_material_id(particle, MATERIAL_FIRE_ID);
-        set_particle_color(particle, 3);
-        set_particle_age(particle, 0);
-      }
-    } 
+  if (y > 0) {
+    spawn_fire(x, y - 1);
+  }
+  if (y < CANVAS_HEIGHT - 1) {
+    spawn_fire(x, y + 1);
+  }
+  if (x > 0) {
+    spawn_fire(x - 1, y);
+  }
+  if (x < CANVAS_WIDTH - 1) {
+    spawn_fire(x + 1, y);
+  }
+}
 
-    if (get_particle_material_id(get_particle(x - 1, y)) == MATERIAL_AIR_ID) {
-      if ((rand() % 100) < 30) {
-        particle_t *particle = get_particle(x - 1, y);
-        set_particle_material_id(particle, MATERIAL_FIRE_ID);
+// Fires the emitters in row y whose event falls in this slot, and dims
+// torches that flared on the previous tick
+void update_emitter_row(uint8_t y, uint8_t slot) {
+  for (int word = 0; word < EMITTER_WORDS_PER_ROW; word++) {
+    uint32_t cells = emitter_cells[y][word];
+    while (cells) {
+      int x = (word << 5) + __builtin_ctz(cells);
+      cells &= cells - 1;
+
+      particle_t *particle = get_particle(x, y);
+      bool is_torch = get_particle_material_id(particle) == MATERIAL_TORCH_ID;
+      if (is_torch) {
         set_particle_color(particle, 3);
-        set_particle_age(particle, 0);
       }
-    } 
+      if (get_particle_age(particle) != slot) {
+        continue;
+      }
 
-    if (get_particle_material_id(get_particle(x + 1, y)) == MATERIAL_AIR_ID) {
-      if ((rand() % 100) < 30) {
-        particle_t *particle = get_particle(x + 1, y);
-        set_particle_material_id(particle, MATERIAL_FIRE_ID);
-        set_particle_color(particle, 3);
-        set_particle_age(particle, 0);
+      if (is_torch) {
+        update_torch(x, y);
+        // Come back next tick to settle the flare
+        mark_emitter_row_due((slot + 1) & (EMITTER_WHEEL_SLOTS - 1), y);
+      } else {
+        update_spout(x, y);
       }
+      schedule_emitter(particle, y);
     }
   }
-
-  return particle;
 }
 
+// Advances the timing wheel and visits only the rows with an emitter due
+// this tick. Rows with no events cost nothing.
+void update_emitters(void) {
+  if (paused) {
+    return;
+  }
+
+  emitter_tick = (emitter_tick + 1) & (EMITTER_WHEEL_SLOTS - 1);
+  uint8_t *due_rows = emitter_due_rows[emitter_tick];
+  for (int i = 0; i < EMITTER_ROW_BYTES; i++) {
+    uint8_t rows = due_rows[i];
+    due_rows[i] = 0;
+    while (rows) {
+      update_emitter_row((i << 3) + __builtin_ctz(rows), emitter_tick);
+      rows &= rows - 1;
+    }
+  }
+}
 
 particle_t* update_lava(uint8_t x, uint8_t y) {
   particle_t *particle = get_particle(x, y);
@@ -454,10 +614,196 @@ void clear_particles() {
       *get_particle(x, y) = 0;
     }
   }
+  for (int y = 0; y < CANVAS_HEIGHT; y++) {
+    for (int word = 0; word < EMITTER_WORDS_PER_ROW; word++) {
+      emitter_cells[y][word] = 0;
+    }
+  }
+  for (int slot = 0; slot < EMITTER_WHEEL_SLOTS; slot++) {
+    for (int i = 0; i < EMITTER_ROW_BYTES; i++) {
+      emitter_due_rows[slot][i] = 0;
+    }
+  }
+  mark_canvas_dirty();
+
+  for (int i = 0; i < 16; i++) {
+    material_counts[i] = 0;
+  }
+  material_counts[MATERIAL_AIR_ID] = CANVAS_WIDTH * CANVAS_HEIGHT;
+  world_at_rest = false;
+}
+
+// Saved worlds are split into CHUNK_SIZE x CHUNK_SIZE chunks. The file is a
+// header, a bitmap of non-empty chunks, then for each non-empty chunk its
+// materials in row-major order as runs of (material << 4 | (length - 1)).
+// Colour, age and update bits are derived state and are not stored.
+#define CHUNK_SIZE 8
+#define CHUNKS_X (CANVAS_WIDTH / CHUNK_SIZE)
+#define CHUNKS_Y (CANVAS_HEIGHT / CHUNK_SIZE)
+#define CHUNK_COUNT (CHUNKS_X * CHUNKS_Y)
+#define CHUNK_BITMAP_BYTES ((CHUNK_COUNT + 7) / 8)
+
+#define WORLD_FILE_VERSION 1
+#define WORLD_FILE_HEADER_BYTES 6
+#define WORLD_FILE_MAX_BYTES 1024 // WASM-4 persistent storage limit
+
+static uint8_t world_file[WORLD_FILE_MAX_BYTES];
+
+bool is_chunk_empty(int chunk_x, int chunk_y) {
+  for (int y = chunk_y * CHUNK_SIZE; y < (chunk_y + 1) * CHUNK_SIZE; y++) {
+    for (int x = chunk_x * CHUNK_SIZE; x < (chunk_x + 1) * CHUNK_SIZE; x++) {
+      if (get_particle_material_id(get_particle(x, y)) != MATERIAL_AIR_ID) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Returns the number of bytes written, or 0 if the world does not fit
+uint32_t encode_world(uint8_t *file, uint32_t capacity) {
+  uint32_t size = WORLD_FILE_HEADER_BYTES + CHUNK_BITMAP_BYTES;
+  if (capacity < size) {
+    return 0;
+  }
+
+  file[0] = 'S';
+  file[1] = 'G';
+  file[2] = WORLD_FILE_VERSION;
+  file[3] = CHUNK_SIZE;
+  file[4] = CHUNKS_X;
+  file[5] = CHUNKS_Y;
+
+  uint8_t *bitmap = &file[WORLD_FILE_HEADER_BYTES];
+  for (int i = 0; i < CHUNK_BITMAP_BYTES; i++) {
+    bitmap[i] = 0;
+  }
+
+  for (int chunk = 0; chunk < CHUNK_COUNT; chunk++) {
+    int chunk_x = chunk % CHUNKS_X;
+    int chunk_y = chunk / CHUNKS_X;
+    if (is_chunk_empty(chunk_x, chunk_y)) {
+      continue;
+    }
+    bitmap[chunk >> 3] |= 1 << (chunk & 0b111);
+
+    int run_material = -1;
+    int run_length = 0;
+    for (int cell = 0; cell <= CHUNK_SIZE * CHUNK_SIZE; cell++) {
+      int material = -1;
+      if (cell < CHUNK_SIZE * CHUNK_SIZE) {
+        int x = chunk_x * CHUNK_SIZE + cell % CHUNK_SIZE;
+        int y = chunk_y * CHUNK_SIZE + cell / CHUNK_SIZE;
+        material = get_particle_material_id(get_particle(x, y));
+      }
+
+      if (material == run_material && run_length < 16) {
+        run_length++;
+        continue;
+      }
+      if (run_length > 0) {
+        if (size >= capacity) {
+          return 0;
+        }
+        file[size++] = (run_material << 4) | (run_length - 1);
+      }
+      run_material = material;
+      run_length = 1;
+    }
+  }
+
+  return size;
+}
+
+// Checks the header and that every flagged chunk holds runs of placeable
+// materials covering exactly CHUNK_SIZE * CHUNK_SIZE cells, with no bytes
+// left over at the end
+bool is_world_file_valid(const uint8_t *file, uint32_t size) {
+  if (size < WORLD_FILE_HEADER_BYTES + CHUNK_BITMAP_BYTES ||
+      file[0] != 'S' || file[1] != 'G' ||
+      file[2] != WORLD_FILE_VERSION ||
+      file[3] != CHUNK_SIZE || file[4] != CHUNKS_X || file[5] != CHUNKS_Y) {
+    return false;
+  }
+
+  const uint8_t *bitmap = &file[WORLD_FILE_HEADER_BYTES];
+  uint32_t offset = WORLD_FILE_HEADER_BYTES + CHUNK_BITMAP_BYTES;
+  for (int chunk = 0; chunk < CHUNK_COUNT; chunk++) {
+    if ((bitmap[chunk >> 3] & (1 << (chunk & 0b111))) == 0) {
+      continue;
+    }
+
+    int cell = 0;
+    while (cell < CHUNK_SIZE * CHUNK_SIZE) {
+      if (offset >= size || (file[offset] >> 4) > MATERIAL_SPOUT_ID) {
+        return false;
+      }
+      cell += (file[offset] & 0b1111) + 1;
+      offset++;
+    }
+    if (cell != CHUNK_SIZE * CHUNK_SIZE) {
+      return false;
+    }
+  }
+
+  return offset == size;
+}
+
+// Replaces the current world. Leaves it untouched if the file is invalid.
+bool decode_world(const uint8_t *file, uint32_t size) {
+  if (!is_world_file_valid(file, size)) {
+    return false;
+  }
+
+  // An empty world (always the case at boot) has nothing to reset, so loading
+  // only touches the chunks in the file
+  if (get_material_count(MATERIAL_AIR_ID) != CANVAS_WIDTH * CANVAS_HEIGHT) {
+    clear_particles();
+  }
+
+  const uint8_t *bitmap = &file[WORLD_FILE_HEADER_BYTES];
+  uint32_t offset = WORLD_FILE_HEADER_BYTES + CHUNK_BITMAP_BYTES;
+  for (int chunk = 0; chunk < CHUNK_COUNT; chunk++) {
+    if ((bitmap[chunk >> 3] & (1 << (chunk & 0b111))) == 0) {
+      continue;
+    }
+
+    int chunk_x = chunk % CHUNKS_X;
+    int chunk_y = chunk / CHUNKS_X;
+    int cell = 0;
+    while (cell < CHUNK_SIZE * CHUNK_SIZE) {
+      uint8_t material = file[offset] >> 4;
+      int run_length = (file[offset] & 0b1111) + 1;
+      offset++;
+
+      for (; run_length > 0; run_length--, cell++) {
+        if (material != MATERIAL_AIR_ID) {
+          place_material(chunk_x * CHUNK_SIZE + cell % CHUNK_SIZE, chunk_y * CHUNK_SIZE + cell / CHUNK_SIZE, material);
+        }
+      }
+    }
+  }
+
+  return true;
+}
+
+bool save_world(void) {
+  uint32_t size = encode_world(world_file, WORLD_FILE_MAX_BYTES);
+  if (size == 0) {
+    return false;
+  }
+  return diskw(world_file, size) == size;
+}
+
+bool load_world(void) {
+  uint32_t size = diskr(world_file, WORLD_FILE_MAX_BYTES);
+  return decode_world(world_file, size);
 }
 
 void start(void) {
-  clear_particles();
+  if (!load_world()) {
+    clear_particles();
+  }
   
   // From https://lospec.com/palette-list/coldfire-gb
   PALETTE[0] = 0x46425e;
@@ -465,23 +811,22 @@ void start(void) {
   PALETTE[2] = 0x5b768d;
   PALETTE[3] = 0xd17c7c;
 
-  // Hide gamepad overlay
-  *SYSTEM_FLAGS = 0x2;
+  // Hide gamepad overlay, and keep the framebuffer between frames so only
+  // changed cells need to be redrawn
+  *SYSTEM_FLAGS = SYSTEM_HIDE_GAMEPAD_OVERLAY | SYSTEM_PRESERVE_FRAMEBUFFER;
 }
 
-uint8_t previous_gamepad;
-uint8_t previous_mouse;
-void update(void) {
-  uint8_t gamepad = *GAMEPAD1;
-  uint8_t mouse = *MOUSE_BUTTONS;
-  uint8_t gamepad_this_frame = gamepad & (gamepad ^ previous_gamepad);
-  uint8_t mouse_this_frame = mouse & (mouse ^ previous_mouse);
-  previous_gamepad = gamepad;
-  previous_mouse = mouse;
-
-  static int pen_size = 1;
-  static int primary_material_id = 1;
-  static int secondary_material_id = 2;
+// Advances the world by one tick, updating particle state along with the
+// census and the dirty canvas bytes. Nothing is drawn here; present_canvas()
+// reads the grid afterwards. Does nothing while the world is at rest.
+void simulate(void) {
+  if (world_at_rest) {
+    return;
+  }
+  cells_moved = 0;
+  reactions_fired = 0;
+  cells_edited = 0;
+  simulating = true;
 
   for (int x = CANVAS_WIDTH; x >= 0; x--) {
     for (int y = CANVAS_HEIGHT - 1; y >= 0; y--) {
@@ -510,21 +855,186 @@ void update(void) {
           set_particle_color(particle, 0);
           break;
         case MATERIAL_TORCH_ID:
-          particle = update_torch(x, y);
-          break;
         case MATERIAL_SPOUT_ID:
-          particle = update_spout(x, y);
+          // Handled by update_emitters()
           break;
         default:
           break;
       }
 
       set_particle_updated(particle, true);
-      *DRAW_COLORS = get_particle_color(particle) + 1;
-      pixel(x, y);
     }
   }
+
+  // After the cell pass, so the air a spout colours isn't reset to 0 before
+  // it is presented
+  update_emitters();
+  simulating = false;
+
+  // Paused ticks move nothing, so they say nothing about being settled
+  world_at_rest = !paused &&
+    cells_moved == 0 &&
+    reactions_fired == 0 &&
+    get_material_count(MATERIAL_FIRE_ID) == 0 &&
+    get_material_count(MATERIAL_LAVA_ID) == 0 &&
+    get_material_count(MATERIAL_TORCH_ID) == 0 &&
+    get_material_count(MATERIAL_SPOUT_ID) == 0;
+}
+
+// Rewrites the framebuffer bytes whose cells changed colour since the last
+// call, packing four 2bpp particle colours per byte.
+void present_canvas(void) {
+  for (int y = 0; y < CANVAS_HEIGHT; y++) {
+    uint64_t dirty = dirty_canvas_bytes[y] & ((1ULL << (CANVAS_WIDTH >> 2)) - 1);
+    if (dirty == 0) {
+      continue;
+    }
+
+    uint8_t *row = &FRAMEBUFFER[(y * SCREEN_SIZE) >> 2];
+    while (dirty) {
+      int x = __builtin_ctzll(dirty) << 2;
+      dirty &= dirty - 1;
+      row[x >> 2] = get_particle_color(get_particle(x, y))
+        | (get_particle_color(get_particle(x + 1, y)) << 2)
+        | (get_particle_color(get_particle(x + 2, y)) << 4)
+        | (get_particle_color(get_particle(x + 3, y)) << 6);
+    }
+    dirty_canvas_bytes[y] = 0;
+  }
+}
+
+// Framebuffer bytes of the canvas covered by a rectangle, as a row mask
+uint64_t rect_canvas_bytes(int x, int width) {
+  int first = x < 0 ? 0 : x;
+  int last = x + width - 1 >= CANVAS_WIDTH ? CANVAS_WIDTH - 1 : x + width - 1;
+  if (first > last) {
+    return 0;
+  }
+  return ((1ULL << ((last >> 2) + 1)) - 1) & ~((1ULL << (first >> 2)) - 1);
+}
+
+void mark_rect_dirty(int x, int y, int width, int height) {
+  uint64_t bytes = rect_canvas_bytes(x, width);
+  for (int row = y < 0 ? 0 : y; row < y + height && row < CANVAS_HEIGHT; row++) {
+    dirty_canvas_bytes[row] |= bytes;
+  }
+}
+
+bool is_rect_dirty(int x, int y, int width, int height) {
+  uint64_t bytes = rect_canvas_bytes(x, width);
+  for (int row = y < 0 ? 0 : y; row < y + height && row < CANVAS_HEIGHT; row++) {
+    if (dirty_canvas_bytes[row] & bytes) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Presents the canvas, then the cursor, menu and selection indicators on top.
+// The framebuffer is preserved between frames, so each layer is only redrawn
+// when something under it or one of its inputs changed.
+void draw_frame(int primary_material_id, int secondary_material_id, int pen_size) {
+  static bool hud_drawn = false;
+  static int drawn_cursor_x, drawn_cursor_y, drawn_pen_size;
+  static int drawn_primary_material_id, drawn_secondary_material_id;
+  static bool drawn_paused;
+
+  int cursor_x = 1 + *MOUSE_X + (pen_size / 2) - pen_size;
+  int cursor_y = 1 + *MOUSE_Y + (pen_size / 2) - pen_size;
+  bool cursor_moved = !hud_drawn ||
+    cursor_x != drawn_cursor_x ||
+    cursor_y != drawn_cursor_y ||
+    pen_size != drawn_pen_size ||
+    primary_material_id != drawn_primary_material_id;
+
+  if (cursor_moved && hud_drawn) {
+    // Uncover the canvas under the old cursor
+    mark_rect_dirty(drawn_cursor_x, drawn_cursor_y, drawn_pen_size, drawn_pen_size);
+  }
+  bool cursor_dirty = cursor_moved || is_rect_dirty(cursor_x, cursor_y, pen_size, pen_size);
+
+  present_canvas();
+
+  // Draw cursor
+  if (cursor_dirty) {
+    *DRAW_COLORS = cursor_colors[primary_material_id - 1] + 1;
+    rect(cursor_x, cursor_y, pen_size, pen_size);
+  }
+
+  bool menu_dirty = !hud_drawn ||
+    primary_material_id != drawn_primary_material_id ||
+    secondary_material_id != drawn_secondary_material_id ||
+    pen_size != drawn_pen_size ||
+    paused != drawn_paused ||
+    (cursor_dirty && cursor_y + pen_size > CANVAS_HEIGHT) ||
+    (cursor_moved && drawn_cursor_y + drawn_pen_size > CANVAS_HEIGHT);
+
+  drawn_cursor_x = cursor_x;
+  drawn_cursor_y = cursor_y;
+  drawn_pen_size = pen_size;
+  drawn_primary_material_id = primary_material_id;
+  drawn_secondary_material_id = secondary_material_id;
+  drawn_paused = paused;
+  hud_drawn = true;
+
+  if (!menu_dirty) {
+    return;
+  }
+
+  // Draw menu sprite
+  *DRAW_COLORS = 0x4321;
+  blit(menu, 0, CANVAS_HEIGHT, MENU_WIDTH, MENU_HEIGHT, MENU_FLAGS);
+  // Draw play sprite
+  if (paused) {
+    blit(play, 120, CANVAS_HEIGHT + 19, PLAY_WIDTH, PLAY_HEIGHT, PLAY_FLAGS);
+  }
+  
+  // Draw primary material dot
+  *DRAW_COLORS = 4;
+  int row_index = ((primary_material_id % 4) == 0 ? 4 : primary_material_id / 4);
+  int col_index = ((primary_material_id % 4) == 0 ? 4 : primary_material_id % 4);
+  pixel((row_index * 40) + 2, (col_index * 9) + CANVAS_HEIGHT - 3);
+  
+  // Draw secondary material dot
+  *DRAW_COLORS = 3;
+  row_index = ((secondary_material_id % 4) == 0 ? 4 : secondary_material_id / 4);
+  col_index = ((secondary_material_id % 4) == 0 ? 4 : secondary_material_id % 4);
+  pixel((row_index * 40) + 2, (col_index * 9) + CANVAS_HEIGHT - 2);
   
+  // Draw pen size indicator
+  *DRAW_COLORS = 3;
+  rect(152 + (pen_size / 2) - pen_size, CANVAS_HEIGHT + 34 + (pen_size / 2) - pen_size, pen_size, pen_size);
+}
+
+uint8_t previous_gamepad;
+uint8_t previous_mouse;
+void update(void) {
+  uint8_t gamepad = *GAMEPAD1;
+  uint8_t mouse = *MOUSE_BUTTONS;
+  uint8_t gamepad_this_frame = gamepad & (gamepad ^ previous_gamepad);
+  uint8_t mouse_this_frame = mouse & (mouse ^ previous_mouse);
+  previous_gamepad = gamepad;
+  previous_mouse = mouse;
+
+  static int pen_size = 1;
+  static int primary_material_id = 1;
+  static int secondary_material_id = 2;
+
+  // Save/restore the world to persistent storage. Restoring replaces the
+  // canvas, so it needs DOWN held as well. A low buzz means the world was too
+  // large to fit on disk, or there was no valid save to load.
+  bool world_file_ok = true;
+  if (gamepad_this_frame & BUTTON_1) {
+    world_file_ok = save_world();
+  } else if ((gamepad_this_frame & BUTTON_2) && (gamepad & BUTTON_DOWN)) {
+    world_file_ok = load_world();
+  }
+  if (!world_file_ok) {
+    tone(110, 12, 60, TONE_PULSE1 | TONE_MODE3);
+  }
+
+  simulate();
+
   // Attempt to draw material if within canvas
   if (*MOUSE_X <= CANVAS_WIDTH && 
       *MOUSE_X >= 0 && 
@@ -545,19 +1055,25 @@ void update(void) {
         for (int j = 1; j <= pen_size; j++){
           int x = 1 + *MOUSE_X + (pen_size / 2) - i;
           int y = 1 + *MOUSE_Y + (pen_size / 2) - j;
-          // Hacky fix to prevent out-of-bounds memory access
-          particle_t *particle = get_particle(x, y >= 0 ? y : 0);
+          // Keep the pen on the canvas so edge strokes don't alias into
+          // neighbouring rows or past the grid
+          int column = x < 0 ? 0 : (x >= CANVAS_WIDTH ? CANVAS_WIDTH - 1 : x);
+          int row = y < 0 ? 0 : (y >= CANVAS_HEIGHT ? CANVAS_HEIGHT - 1 : y);
+          particle_t *particle = get_particle(column, row);
 
           if (*selected_id == MATERIAL_ERASE_ID){
+            if (is_emitter_material(get_particle_material_id(particle))) {
+              unregister_emitter(column, row);
+            }
             set_particle_material_id(particle, MATERIAL_AIR_ID); 
           } else if (get_particle_material_id(particle) == MATERIAL_AIR_ID) {
             if (pen_size > 1 && *selected_id != MATERIAL_GLASS_ID){
               // Don't scatter the particles if the game is paused
               if(paused || ((rand() % 100) < 40)) {
-                set_particle_material_id(particle, *selected_id); 
+                place_material(column, row, *selected_id);
               }
             } else {
-              set_particle_material_id(particle, *selected_id); 
+              place_material(column, row, *selected_id);
             }
           }
         }
@@ -565,18 +1081,6 @@ void update(void) {
     }
   }
   
-  // Draw cursor
-  *DRAW_COLORS = cursor_colors[primary_material_id - 1] + 1;
-  rect(1 + *MOUSE_X + (pen_size / 2) - pen_size, 1 + *MOUSE_Y + (pen_size / 2) - pen_size, pen_size, pen_size);
-
-  // Draw menu sprite
-  *DRAW_COLORS = 0x4321;
-  blit(menu, 0, CANVAS_HEIGHT, MENU_WIDTH, MENU_HEIGHT, MENU_FLAGS);
-  // Draw play sprite
-  if (paused) {
-    blit(play, 120, CANVAS_HEIGHT + 19, PLAY_WIDTH, PLAY_HEIGHT, PLAY_FLAGS);
-  }
-  
   // Attempt to pick new material type
   if (*MOUSE_X < 160 && *MOUSE_X >= 0 && *MOUSE_Y > CANVAS_HEIGHT && mouse_this_frame){
     int col = *MOUSE_X / 40;
@@ -608,19 +1112,5 @@ void update(void) {
     }
   }
   
-  // Draw primary material dot
-  *DRAW_COLORS = 4;
-  int row_index = ((primary_material_id % 4) == 0 ? 4 : primary_material_id / 4);
-  int col_index = ((primary_material_id % 4) == 0 ? 4 : primary_material_id % 4);
-  pixel((row_index * 40) + 2, (col_index * 9) + CANVAS_HEIGHT - 3);
-  
-  // Draw secondary material dot
-  *DRAW_COLORS = 3;
-  row_index = ((secondary_material_id % 4) == 0 ? 4 : secondary_material_id / 4);
-  col_index = ((secondary_material_id % 4) == 0 ? 4 : secondary_material_id % 4);
-  pixel((row_index * 40) + 2, (col_index * 9) + CANVAS_HEIGHT - 2);
-  
-  // Draw pen size indicator
-  *DRAW_COLORS = 3;
-  rect(152 + (pen_size / 2) - pen_size, CANVAS_HEIGHT + 34 + (pen_size / 2) - pen_size, pen_size, pen_size);
+  draw_frame(primary_material_id, secondary_material_id, pen_size);
 }